@@ -37,12 +37,44 @@ static const int fixedsize_alignment[slot_type_count] = {
 static const int fixedsize_block_size[slot_type_count] = {
     8,      504,    248,    128 };
 
+#define variable_slot_count 61
+static const int variable_end = 61;            // index of the end address of the allocation area
+static const int variable_bitmap = 62;
+static const int variable_address = 63;
+
+#ifndef ZONE_FIXED_BLOCKS
+#define ZONE_FIXED_BLOCKS 8                    // fixed size allocation blocks at the start of a zone, one for each of up to 8 threads
+#endif
+
+static const int master_slot_count = 61 - ZONE_FIXED_BLOCKS;
+static const int master_owners = 61 - ZONE_FIXED_BLOCKS;   // owner of each fixed size allocation block of a zone
+static const int master_heap = 61;             // heap of a zone
+static const int master_variable_failed = 62;  // range of variable sizes which do not fit in a zone
+static const int owner_full_shift = 32;        // bits of the slot types found full in a block follow its owner
+#ifndef ZONE_SIZE
+#define ZONE_SIZE (64 * 1024)                  // alignment of the zones and size of most, a power of two
+#endif
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+static const size_t max_request = SIZE_MAX / 2;   // bound on sizes and alignments so that zone sizes do not overflow
+
+#ifndef MIN_ZONE_AREA
+#define MIN_ZONE_AREA (variable_slot_count * 2 * alignment)  // every slot of a variable size block fits the smallest variable size
+#endif
+
 #ifndef MAX_HOARD
 #define MAX_HOARD 3000
 #endif
+#ifndef HOARD_REUSE
+#define HOARD_REUSE 4                          // hoarded entries looked at for an allocation
+#endif
 
-__thread void **freed_list = NULL;
-__thread size_t hoard_size = 0;
+static int thread_count = 0;   // thread indices handed out
+__thread int thread_index = -1;
+static int *free_indices = NULL;        // indices of the threads which exited
+static int free_index_count = 0;
+static int free_index_capacity = 0;
 
 #if defined USE_PTHREAD || !defined MUTEX_TYPE
 #include <pthread.h>
@@ -52,6 +84,11 @@ typedef pthread_mutex_t mutex;
 #define mutex_lock pthread_mutex_lock
 #define mutex_unlock pthread_mutex_unlock
 #define mutex_destroy pthread_mutex_destroy
+#define at_fork pthread_atfork
+
+typedef pthread_key_t thread_key;
+#define thread_key_create pthread_key_create
+#define thread_key_set pthread_setspecific
 
 #else
 typedef MUTEX_TYPE mutex;
@@ -59,10 +96,63 @@ extern void mutex_init(mutex*);
 extern int mutex_lock(mutex*);
 extern int mutex_unlock(mutex*);
 extern int mutex_destroy(mutex*);       // returns non-zero if mutex locked
+extern int at_fork(void (*prepare)(void), void (*parent)(void), void (*child)(void));
+
+typedef THREAD_KEY_TYPE thread_key;
+extern int thread_key_create(thread_key*, void (*destructor)(void*));
+extern int thread_key_set(thread_key, const void*);
+#endif
+
+static mutex heap_init_lock;     // held while the list of heaps changes
+
+#ifndef REGION_SIZE
+#define REGION_SIZE (4 << 20)   // memory mapped at once for the zones of a heap, a multiple of ZONE_SIZE
 #endif
 
-static void *heap_start = NULL;
-static mutex heap_init_lock;
+typedef struct region
+{
+    char *memory;               // mapping, including the guard pages
+    size_t size;
+    struct region *next;
+} region;
+
+typedef struct bt_heap
+{
+    aligned_uint *master;       // root master allocation block
+    aligned_uint *volatile recent;      // zone added last
+    mutex zone_lock;            // held while a zone is added
+    volatile int zone_count;    // zones linked in the tree
+    volatile int cursor;        // position of the zone where a search last succeeded
+    size_t failed_size;         // variable size no zone could hold
+    size_t failed_bound;        // nor any size from it up to this bound
+    int failed_freed;           // value of freed_zones when it failed
+    region *regions;            // memory mapped for the zones
+    char *region_free;          // rest of the latest region, zone_lock held while it changes
+    char *region_end;
+    unsigned id;                // never reused, unlike the address of the heap
+    struct bt_heap *next;
+} bt_heap;
+static bt_heap *volatile default_heap = NULL;
+static bt_heap *heaps = NULL;
+static unsigned heap_ids = 0;
+
+__thread unsigned recent_heap = 0;      // id of the heap of the latest allocation of the thread
+__thread aligned_uint *recent_zone = NULL;
+
+typedef struct hoard
+{
+    void **freed_list;          // hoarded memory, most recent first
+    size_t hoard_size;
+    mutex lock;                 // held while the list changes
+    int registered;
+    struct hoard *next;
+} hoard;
+__thread hoard thread_hoard;
+static hoard *hoards = NULL;    // hoards of all threads, heap_init_lock held while it changes
+static thread_key hoard_key;    // releases the hoard when the thread exits
+static thread_key index_key;    // gives the thread index back when the thread exits
+
+static volatile int freed_zones = 0;    // counts frees in zones which were found full
 
 typedef struct cached_block
 {
@@ -103,6 +193,40 @@ static const union
 extern int compare_and_set();
 #endif
 
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef HARDENED
+
+// Report a corrupted heap or an invalid use of the allocator and stop
+static void heap_error(const char *const error, const void *const address)
+{
+    fprintf(stderr, "btmalloc: %s (%p)\n", error, address);
+    abort();
+}
+#define check_heap(C, E, A) do { if ( !(C) ) heap_error(E, A); } while (0)
+
+#else
+#define check_heap(C, E, A) assert( C )
+#endif
+
+#ifdef RANDOM_SLOTS
+__thread aligned_uint random_state = 0;
+
+// Pseudo-random bit shift (xorshift) among the contiguous bits of slots
+static int random_shift(aligned_uint slots)
+{
+    if ( random_state == 0 )
+    {
+        random_state = (uintptr_t) &random_state | 1;
+    }
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return __builtin_ctzll(slots) + (random_state >> 32) % __builtin_popcountll(slots);
+}
+#endif
+
 
 /*
    Memory hierarchy
@@ -239,7 +363,9 @@ extern int compare_and_set();
    For this reason, the end address for a memory allocation
    larger than 504 bytes falls 8 bytes before a 512-bytes block
    boundary to avoid memory wastage, unless a different align-
-   ment is specified.
+   ment is specified. A smaller area which would straddle a
+   boundary tag starts at the 512-bytes block boundary instead,
+   and holds the gap before it.
 */
 /*
    Allocation of memory
@@ -277,15 +403,22 @@ extern int compare_and_set();
    the bitmap and its address is returned. In case of variable
    size allocation, if the requested size is less than the
    available size a neighbouring free allocation slot is resized
-   accordingly if there is one.
+   accordingly if there is one. If there is none, the area is
+   only used when it is at most twice the requested size.
+   
+   When a larger alignment is requested, the memory area starts
+   at the first aligned address of the free memory. The gap in
+   front of it stays in the free slot and the area takes the
+   next slot, which has to be free too.
    
    If no suitable slot is found in any allocation block, then a 
    new allocation zone may be created and linked to a master 
-   allocation block. A variable size allocation block is added
+   allocation block. Variable size allocation blocks are added
    at the beginning of the allocation zone.
    
    A predictor is used to estimate the free space needs of the 
-   allocation zone.
+   allocation zone. Each variable size allocation block of the
+   zone gets enough memory for the predicted size in each slot.
    
    When a fixed size allocation block has no free slot, a new 
    fixed size allocation block may be created in the free space 
@@ -362,6 +495,14 @@ extern int compare_and_set();
    
    If zeroing fails and the memory cannot be added to the freed
    list, then the thread tries harder to set the bit to zero.
+   
+   When built with HARDENED, a bit which is already zero is
+   reported as a double free instead of being asserted. Freed
+   memory is not hoarded then, so that its bit always gets
+   cleared. The boundary tags and slot type tags are validated,
+   as well as the address of the freed memory, and the regions
+   the zones are carved out of are fenced by guard pages.
+   RANDOM_SLOTS picks fixed-size slots at random.
 */
 /*
    Concurrency and synchronisation
@@ -428,8 +569,11 @@ aligned_uint *allocation_block(const void *const allocated)
     }
     else
     {
-        // The info block indicates the address of the allocation block
-        assert( info < (uintptr_t) boundary && info >= (uintptr_t) heap_start );
+        // The info block indicates the address of the allocation block,
+        // which ends with the same address
+        check_heap( info <= (uintptr_t) boundary && info % block_size == 0 && info != 0,
+            "invalid boundary tag", allocated );
+        check_heap( *((aligned_uint*) info - 1) == info, "invalid boundary tag", allocated );
         return (aligned_uint*) info;
     }
 }
@@ -451,25 +595,31 @@ static int bitmap_slot_type(aligned_uint b)
 }
 
 // Locate the bitmap of a fixed-size block corresponding to
-// the specified memory slot
-static aligned_uint *fixedsize_block(const void *const allocated)
+// the specified memory slot and identify its slot type. A slot
+// type other than -1 is checked first.
+static aligned_uint *fixedsize_block(const void *const allocated, int *const slot_type)
 {
     aligned_uint *const block = (aligned_uint*) ((uintptr_t) allocated & ~((uintptr_t) block_size - 1));
     
     // Address of bitmap
     aligned_uint *bitmap = block + (block_size / alignment - 1);
     aligned_uint *next = NULL;
+    int guess = *slot_type;
     
     // Look for the proper block within the allocation block
     do {
-        assert( bitmap >= block && *bitmap != 0 );
+        check_heap( bitmap >= block && *bitmap != 0, "invalid slot type", allocated );
         
         // Identify the slot type
-        int slot_type = bitmap_slot_type(*bitmap);
-        assert( slot_type != -1 );
+        int type = guess;
+        if ( type == -1 || (*bitmap & fixedsize_mask[type]) != (aligned_uint) fixedsize_test[type] )
+        {
+            type = bitmap_slot_type(*bitmap);
+        }
+        check_heap( type != -1, "invalid slot type", allocated );
         
         // Calculate the address of the next bitmap (or info block)
-        next = (aligned_uint*) ((char*) bitmap - fixedsize_block_size[slot_type]);
+        next = (aligned_uint*) ((char*) bitmap - fixedsize_block_size[type]);
         // The start of the current block should be within the
         // allocation block
         assert( next + 1 >= block );
@@ -478,6 +628,7 @@ static aligned_uint *fixedsize_block(const void *const allocated)
         if ( allocated >= (void*) (next + 1) )
         {
             // Found it!
+            *slot_type = type;
             return bitmap;
         }
         
@@ -487,11 +638,15 @@ static aligned_uint *fixedsize_block(const void *const allocated)
 }
 
 // Clear the specified allocation bit in bitmap
-static int clear_bit(v_aligned_uint_ptr bitmap, int shift)
+static int clear_bit(v_aligned_uint_ptr bitmap, int shift, const void *const allocated)
 {
     aligned_uint b = *bitmap;
     aligned_uint freed = b & ~(((aligned_uint) 1) << shift);
-    assert( freed != b );   // No other thread should clear the bit
+    
+    // No other thread should clear the bit; the compare-and-set
+    // fails if it did after the check
+    check_heap( freed != b, "double free", allocated );
+    (void) allocated;       // only reported in hardened mode
     return compare_and_set(bitmap, b, freed);
 }
 
@@ -504,7 +659,15 @@ static void *unhoard(void **next)
     return memory;
 }
 
-static size_t free_fixed_size_memory(void *const allocated, aligned_uint *const block, int fail_early);
+// Zone of an allocation block. Zones are aligned on ZONE_SIZE and
+// their allocation blocks lie within the first ZONE_SIZE bytes.
+static aligned_uint *block_zone(aligned_uint *const block)
+{
+    return (aligned_uint*) ((uintptr_t) block & ~((uintptr_t) ZONE_SIZE - 1));
+}
+
+static size_t free_fixed_size_memory(void *const allocated, aligned_uint *const block, aligned_uint *const zone, int slot_type, int fail_early);
+static size_t free_variable_size_memory(void *const allocated, aligned_uint *const block, int fail_early);
 
 size_t free_internal(void *const memory, int fail_early)
 {
@@ -512,16 +675,27 @@ size_t free_internal(void *const memory, int fail_early)
     aligned_uint info = *(block - 1);
     if ( info & uchar_mask )
     {
-        return free_fixed_size_memory(memory, block, fail_early);
+        return free_fixed_size_memory(memory, block, block_zone(block), -1, fail_early);
     }
     else
     {
-        // TODO - implement this otherwise there is infinite loop
-        assert ( fail_early );
-        return 0;
+        // The info block ends the variable size allocation block
+        return free_variable_size_memory(memory, block - block_size / alignment, fail_early);
     }
 }
 
+// Add the hoard of the thread to the list of hoards
+static void register_hoard(void)
+{
+    mutex_init(&thread_hoard.lock);
+    mutex_lock(&heap_init_lock);
+    thread_hoard.next = hoards;
+    hoards = &thread_hoard;
+    mutex_unlock(&heap_init_lock);
+    thread_key_set(hoard_key, &thread_hoard);
+    thread_hoard.registered = 1;
+}
+
 // Try hoarding freed memory for reuse
 int hoard_freed(size_t size, void *const memory)
 {
@@ -532,17 +706,22 @@ int hoard_freed(size_t size, void *const memory)
         // Not enough space in slot or in hoard
         return 0;
     }
-    while ( hoard_size + size > MAX_HOARD )
+    if ( !thread_hoard.registered )
+    {
+        register_hoard();
+    }
+    mutex_lock(&thread_hoard.lock);
+    while ( thread_hoard.hoard_size + size > MAX_HOARD )
     {
         // Try freeing hoarded memory until hoarding this doesn't exceed maximum
-        void **pred = freed_list;
+        void **pred = (void**) &thread_hoard.freed_list;
         void **tail = *pred;
         
         assert ( tail != NULL );
         if ( tail == NULL )
         {
             // Something went wrong, silently fix
-            hoard_size = 0;
+            thread_hoard.hoard_size = 0;
             break;
         }
         // Find oldest hoarded memory (tail of the list)
@@ -554,24 +733,28 @@ int hoard_freed(size_t size, void *const memory)
         size_t freed = free_internal(tail, 1);   // fail if there is a concurrent update
         if ( freed == 0 )
         {
-            // Failed, move tail to head of freed list
-            unhoard(pred);
-            *tail = freed_list;
-            freed_list = tail;
+            // Failed, move tail to head of freed list unless it is alone
+            if ( tail != thread_hoard.freed_list )
+            {
+                unhoard(pred);
+                *tail = thread_hoard.freed_list;
+                thread_hoard.freed_list = tail;
+            }
         }
         else
         {
             // Remove tail from freed list 
-            *pred = NULL;
-            hoard_size -= freed;
+            unhoard(pred);
+            thread_hoard.hoard_size -= freed;
         }
     }
     
     // Insert as head of freed memory hoarding list
-    void **current = freed_list;
-    freed_list = memory;
+    void **current = thread_hoard.freed_list;
+    thread_hoard.freed_list = memory;
     *(void**) memory = current;
-    hoard_size += size;
+    thread_hoard.hoard_size += size;
+    mutex_unlock(&thread_hoard.lock);
     return 1;
 }
 
@@ -580,6 +763,7 @@ static int get_shift(void *const address, void *const bitmap, int slot_type)
 {
     int slot_size = alignment;
     int offset = 0;
+    int first = 0;
     if ( slot_type != -1 )
     {
         assert( slot_type >= 0 && slot_type < slot_type_count );
@@ -593,29 +777,68 @@ static int get_shift(void *const address, void *const bitmap, int slot_type)
             // slot; otherwise the rightmost
             offset = fixedsize_block_size[slot_type] - ( LITTLE_ENDIAN_CPU? 0: 1 );
         }
+        else
+        {
+            // The lowest bits of the bitmap identify the slot type
+            first = fixedsize_shift[slot_type];
+        }
     }
-    return (bitmap + offset - address) / slot_size;
+    return (bitmap + offset - address) / slot_size + first;
 }
 
-// Free a slot in a fixed-size memory allocation block
-static size_t free_fixed_size_memory(void *const allocated, aligned_uint *const block, int fail_early)
+// Mask of the bits which map memory slots in a fixed-size bitmap
+static aligned_uint fixedsize_slots(int slot_type)
 {
-    assert( ((uintptr_t) block) % block_size == 0 );
-    
-    // Address of bitmap
-    v_aligned_uint_ptr bitmap = fixedsize_block(allocated);
-    assert( *bitmap != 0 );
+    aligned_uint slots = ~(aligned_uint) fixedsize_mask[slot_type];
+    return fixedsize_alignment[slot_type] == 1 ? slots & uchar_mask : slots;
+}
 
-    // Identify the slot size
-    int slot_type = bitmap_slot_type(*bitmap);
-    assert( slot_type != -1 );
-    
-    // Get the shift of the bit in the bitmap
-    int shift = get_shift(allocated, (void*) bitmap, slot_type);
+// Calculate the address of the slot corresponding to a bit in the
+// bitmap of a fixed-size allocation block
+static void *get_slot(void *const bitmap, int slot_type, int shift)
+{
+    assert( slot_type >= 0 && slot_type < slot_type_count );
     
-    // Free memory
-    int freed_size = fixedsize_alignment[slot_type];
-    if ( clear_bit(bitmap, shift) )
+    int slot_size = fixedsize_alignment[slot_type];
+    if ( slot_size == 1 )
+    {
+        return bitmap + fixedsize_block_size[slot_type] - ( LITTLE_ENDIAN_CPU? 0: 1 ) - shift;
+    }
+    return bitmap - (shift - fixedsize_shift[slot_type]) * slot_size;
+}
+
+// Set hint bits which mark a zone as full
+static void set_full_hint(v_aligned_uint_ptr hint, aligned_uint bits)
+{
+    aligned_uint h;
+    do {
+        h = *hint;
+    } while ( !compare_and_set(hint, h, h | bits) );
+}
+
+// Clear hint bits which mark a zone as full once memory was freed in it
+static void clear_full_hint(v_aligned_uint_ptr hint, aligned_uint bits)
+{
+    aligned_uint h = *hint;
+    if ( (h & bits) == 0 )
+    {
+        return;
+    }
+    while ( !compare_and_set(hint, h, h & ~bits) )
+    {
+        h = *hint;
+    }
+    int count;
+    do {
+        count = freed_zones;
+    } while ( !compare_and_set(&freed_zones, count, count + 1) );
+}
+
+// Clear the allocation bit of a slot, hoarding the memory if the
+// bitmap is busy
+static size_t free_slot(v_aligned_uint_ptr bitmap, int shift, size_t freed_size, void *const allocated, int fail_early)
+{
+    if ( clear_bit(bitmap, shift, allocated) )
     {
         // Success!
         return freed_size;
@@ -628,16 +851,19 @@ static size_t free_fixed_size_memory(void *const allocated, aligned_uint *const
             return 0;
         }
 
-        // Let's try hoarding
+#ifndef HARDENED
+        // Let's try hoarding. Not in hardened mode: a hoarded slot
+        // stays marked as used, which hides a second free of it.
         if ( hoard_freed(freed_size, allocated) )
         {
             // It worked!
             return freed_size;
         }
+#endif
 
         // Won't hoard, try harder to free memory (busy loop)
         do {
-            if ( clear_bit(bitmap, shift) )
+            if ( clear_bit(bitmap, shift, allocated) )
             {
                 // Success!
                 return freed_size;
@@ -646,6 +872,109 @@ static size_t free_fixed_size_memory(void *const allocated, aligned_uint *const
     }
 }
 
+// Free a slot in a fixed-size memory allocation block of a zone, or of
+// no zone if NULL. The slot type is a guess or -1.
+static size_t free_fixed_size_memory(void *const allocated, aligned_uint *const block, aligned_uint *const zone, int slot_type, int fail_early)
+{
+    assert( ((uintptr_t) block) % block_size == 0 );
+    
+    // Address of bitmap and slot size
+    v_aligned_uint_ptr bitmap = fixedsize_block(allocated, &slot_type);
+    assert( *bitmap != 0 );
+    
+    // Get the shift of the bit in the bitmap
+    int shift = get_shift(allocated, (void*) bitmap, slot_type);
+#ifdef HARDENED
+    check_heap( get_slot((void*) bitmap, slot_type, shift) == allocated &&
+        (fixedsize_slots(slot_type) & ((aligned_uint) 1) << shift), "invalid free", allocated );
+#endif
+    
+    // Free memory
+    size_t freed = free_slot(bitmap, shift, fixedsize_alignment[slot_type], allocated, fail_early);
+    if ( freed != 0 && zone != NULL )
+    {
+        int index = ((uintptr_t) block - (uintptr_t) zone) / block_size;
+        clear_full_hint(zone + master_owners + index - 1, ((aligned_uint) 1) << (owner_full_shift + slot_type));
+    }
+    return freed;
+}
+
+// Calculate the usable size of an area of variable size allocation
+// memory, leaving out the boundary tag which follows it if needed
+static size_t area_usable(uintptr_t start, uintptr_t limit)
+{
+    // Position of the boundary tag at the end of the 512-bytes block
+    uintptr_t tag = (start | (block_size - 1)) + 1 - alignment;
+    if ( limit < tag )
+    {
+        return limit - start;
+    }
+    return (limit & ~((uintptr_t) block_size - 1)) - alignment - start;
+}
+
+// Calculate the start address of an area of variable size allocation
+// memory in free memory, aligned as requested. An area which fits in a
+// 512-bytes block starts past the boundary tag rather than straddle it.
+static uintptr_t area_start(uintptr_t address, size_t size, size_t align)
+{
+    uintptr_t start = (address + align - 1) & ~((uintptr_t) align - 1);
+    uintptr_t tag = (start | (block_size - 1)) + 1 - alignment;
+    if ( size <= block_size - alignment && start + size > tag )
+    {
+        start = (tag + alignment + align - 1) & ~((uintptr_t) align - 1);
+    }
+    return start;
+}
+
+// Tell whether an area which starts at the 512-bytes boundary following
+// the address of its slot holds the gap before it. Unless the gap is only
+// the boundary tag, its first word is the start address of the area.
+static int holds_gap(uintptr_t address, uintptr_t start)
+{
+    return start % block_size == 0 && start != address && start - address < block_size;
+}
+
+// Find the slot of a variable size allocation block which holds
+// the allocated memory
+static int variable_slot(const void *const allocated, aligned_uint *const block)
+{
+    assert( ((uintptr_t) block) % block_size == 0 );
+    
+    // Empty slots before it have the same address, the slots after it
+    // have larger addresses which other threads cannot lower
+    int slot = variable_slot_count - 1;
+    while ( slot >= 0 && block[slot] > (uintptr_t) allocated )
+    {
+        --slot;
+    }
+    check_heap( slot >= 0 && (block[slot] == (uintptr_t) allocated || (holds_gap(block[slot], (uintptr_t) allocated) &&
+        ((uintptr_t) allocated - block[slot] == alignment || *(aligned_uint*) block[slot] == (uintptr_t) allocated))),
+        "invalid free", allocated );
+    check_heap( block[variable_bitmap] & ((aligned_uint) 1) << slot, "double free", allocated );
+    return slot;
+}
+
+// Free a slot in a variable size memory allocation block
+static size_t free_variable_size_memory(void *const allocated, aligned_uint *const block, int fail_early)
+{
+    v_aligned_uint_ptr bitmap = block + variable_bitmap;
+    int slot = variable_slot(allocated, block);
+    
+    // The slot is in use so the next slot address cannot move
+    size_t freed_size = area_usable((uintptr_t) allocated, block[slot + 1]);
+    if ( (uintptr_t) allocated - block[slot] > alignment )
+    {
+        // Clear the start address held in the gap
+        *(aligned_uint*) block[slot] = 0;
+    }
+    size_t freed = free_slot(bitmap, slot, freed_size, allocated, fail_early);
+    if ( freed != 0 )
+    {
+        clear_full_hint(block_zone(block) + master_variable_failed, ~(aligned_uint) 0);
+    }
+    return freed;
+}
+
 static int increase_predictor_count(int index)
 {
     assert( index >= 0 && index < predictor_size );
@@ -687,7 +1016,7 @@ int update_predictor(size_t alloc_size)
         ++n; 
     }
     assert( n >= 0 );
-    if ( alloc_size != predictor[n] && n >= slot_type_count && fuzz_zone(n) )
+    if ( n < predictor_size && alloc_size != predictor[n] && n >= slot_type_count && fuzz_zone(n) )
     {
         // New alloc size in the fuzz zone, insert it
         int count, index;
@@ -768,30 +1097,1229 @@ int update_predictor(size_t alloc_size)
     return increase_predictor_count(n);
 }
 
-int main(int n, char* args[])
+/*
+    Memory allocation
+*/
+
+// Select the smallest fixed-size slot which can hold the size
+static int fixedsize_slot_type(size_t size)
 {
-    size_t sizes[] = {400, 8, 64, 504, 1, 64, 200, 320, 1000, 800, 3, 184, 640, 208, 720, 480, 240, 800, 560, 720, 1000, 192, 112,
-        1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 6000, 400};
-    for ( int i = 0; i < sizeof(sizes) / sizeof(size_t); ++i )
+    int best = -1;
+    for ( int slot_type = 0; slot_type < slot_type_count; ++slot_type )
     {
-        printf("Alloc %lu - new median: %lu, predictor =", sizes[i], predictor[update_predictor(sizes[i])]);
-        for ( int n = 0; n < slot_type_count || p_count[n] > 0; ++n )
+        if ( (size_t) fixedsize_alignment[slot_type] >= size &&
+            (best == -1 || fixedsize_alignment[slot_type] < fixedsize_alignment[best]) )
         {
-            printf(" (%lu: %u)", predictor[n], p_count[n]);
+            best = slot_type;
         }
-        puts("");
     }
-    printf("CPU type: %s endian\n", LITTLE_ENDIAN_CPU? "little": "big");
-    aligned_uint *block;
-    if ( posix_memalign((void**) &block, block_alignment, block_size) == 0 )
+    return best;
+}
+
+// Mark a free slot of a fixed-size allocation block as used
+static void *allocate_fixed_slot(v_aligned_uint_ptr bitmap, int slot_type)
+{
+    do {
+        aligned_uint b = *bitmap;
+        aligned_uint available = ~b & fixedsize_slots(slot_type);
+        if ( available == 0 )
+        {
+            // No free slot
+            return NULL;
+        }
+        int shift = __builtin_ctzll(available);
+#ifdef RANDOM_SLOTS
+        // Take the first free slot from a random position
+        aligned_uint after = available & (~(aligned_uint) 0 << random_shift(fixedsize_slots(slot_type)));
+        if ( after != 0 )
+        {
+            shift = __builtin_ctzll(after);
+        }
+#endif
+        if ( compare_and_set(bitmap, b, b | ((aligned_uint) 1) << shift) )
+        {
+            return get_slot((void*) bitmap, slot_type, shift);
+        }
+    } while (1);
+}
+
+// Allocate a slot in the fixed size allocation blocks of a 512-bytes
+// block, creating a new fixed size allocation block in the free space
+// that follows if needed
+static void *allocate_fixed_size(aligned_uint *const block, int slot_type)
+{
+    v_aligned_uint_ptr bitmap = block + (block_size / alignment - 1);
+    while ( bitmap >= block )
     {
-        int index = block_size / alignment;
-        aligned_uint bitmap = 0x19;      // 00011001
-        block[--index] = 1;
-        block[--index] = bitmap;
-        free_fixed_size_memory((char*) (block + index) + 4, block, 0);
-        printf("bitmap before free = %llX\n", bitmap);
-        printf("bitmap after free = %llX\n", block[index]);
+        aligned_uint b = *bitmap;
+        if ( b == 0 )
+        {
+            // Free space, check that the new block fits
+            v_aligned_uint_ptr next = (aligned_uint*) ((char*) bitmap - fixedsize_block_size[slot_type]);
+            if ( next + 1 < block )
+            {
+                return NULL;
+            }
+            
+            // Create the block with its first slot in use
+            int shift = __builtin_ctzll(fixedsize_slots(slot_type));
+            aligned_uint created = fixedsize_test[slot_type] | ((aligned_uint) 1) << shift;
+            if ( compare_and_set(bitmap, 0, created) )
+            {
+                update_predictor(fixedsize_alignment[slot_type]);
+                return get_slot((void*) bitmap, slot_type, shift);
+            }
+            
+            // Created concurrently, look at it again
+            continue;
+        }
+        
+        int type = bitmap_slot_type(b);
+        assert( type != -1 );
+        if ( type == slot_type )
+        {
+            void *memory = allocate_fixed_slot(bitmap, slot_type);
+            if ( memory != NULL )
+            {
+                return memory;
+            }
+        }
+        bitmap = (aligned_uint*) ((char*) bitmap - fixedsize_block_size[type]);
+    }
+    return NULL;
+}
+
+// Calculate the end address of an area of variable size allocation
+// memory, so that the area does not end on a boundary tag
+static uintptr_t area_end(uintptr_t start, size_t size)
+{
+    uintptr_t tag = (start | (block_size - 1)) + 1 - alignment;
+    uintptr_t end = start + ((size + alignment - 1) & ~(alignment - 1));
+    if ( end < tag )
+    {
+        return end;
+    }
+    // Leave the boundary tag of the last 512-bytes block unallocated
+    return (end + alignment + block_size - 1) & ~((uintptr_t) block_size - 1);
+}
+
+// Mark slots of a variable size allocation block as free
+static void clear_bits(v_aligned_uint_ptr bitmap, aligned_uint bits)
+{
+    aligned_uint b;
+    do {
+        b = *bitmap;
+        assert( (b & bits) == bits );
+    } while ( !compare_and_set(bitmap, b, b & ~bits) );
+}
+
+// Check that the size fits in free memory spanning the given number
+// of slots. Without another slot to hold the rest of the free memory
+// the area would take all of it, which is allowed up to twice the size.
+static int area_fits(uintptr_t start, uintptr_t limit, size_t size, int slots)
+{
+    if ( slots == 0 || start >= limit )
+    {
+        return 0;
+    }
+    size_t usable = area_usable(start, limit);
+    return size <= usable && (slots > 1 || usable - size <= size);
+}
+
+// Allocate an area of memory in a variable size allocation block.
+// If the area does not start where the free memory does, or at the
+// 512-bytes boundary which follows, the gap before it stays in the free
+// slot and the area takes the next one.
+// Refused is lowered to the usable size of free memory left whole since
+// it is more than twice the size, or to 0 if the block changed meanwhile.
+static void *allocate_variable_size(aligned_uint *const block, size_t size, size_t align, size_t *const refused)
+{
+    v_aligned_uint_ptr bitmap = block + variable_bitmap;
+    aligned_uint slots = (((aligned_uint) 1) << variable_slot_count) - 1;
+    for ( int slot = 0; slot < variable_slot_count; ++slot )
+    {
+        // Go straight to the next free slot
+        aligned_uint b = *bitmap;
+        aligned_uint available = ~b & slots & (~(aligned_uint) 0 << slot);
+        if ( available == 0 )
+        {
+            return NULL;
+        }
+        slot = __builtin_ctzll(available);
+        aligned_uint first = ((aligned_uint) 1) << slot;
+        
+        // The free slots which follow get merged to hold the rest
+        // of the free memory
+        aligned_uint used = first;
+        int last = slot + 1;
+        while ( last < variable_slot_count && !(b & used << 1) )
+        {
+            used |= used << 1;
+            ++last;
+        }
+        uintptr_t start = area_start(block[slot], size, align);
+        int area = start == block[slot] || holds_gap(block[slot], start) ? slot : slot + 1;
+        if ( !area_fits(start, block[last], size, last - area) )
+        {
+            if ( last > area && start < block[last] && area_usable(start, block[last]) >= size &&
+                area_usable(start, block[last]) < *refused )
+            {
+                *refused = area_usable(start, block[last]);
+            }
+            // Starting later in the same free memory leaves less room
+            slot = last - 1;
+            continue;
+        }
+        
+        if ( !compare_and_set(bitmap, b, b | used) )
+        {
+            // The bitmap was updated concurrently, look again
+            --slot;
+            continue;
+        }
+        
+        // Read the slots again now that no other thread can modify them
+        start = area_start(block[slot], size, align);
+        area = start == block[slot] || holds_gap(block[slot], start) ? slot : slot + 1;
+        uintptr_t limit = block[last];
+        if ( !area_fits(start, limit, size, last - area) )
+        {
+            // Changed concurrently, the result cannot serve as a hint
+            *refused = 0;
+            clear_bits(bitmap, used);
+            continue;
+        }
+        if ( area != slot )
+        {
+            // Give the leading gap back
+            block[area] = start;
+        }
+        else if ( start - block[slot] > alignment )
+        {
+            // Record that the area holds the gap before it
+            *(aligned_uint*) block[slot] = start;
+        }
+        if ( area + 1 < last )
+        {
+            block[area + 1] = area_end(start, size);
+            for ( int empty = area + 2; empty < last; ++empty )
+            {
+                block[empty] = limit;
+            }
+        }
+        
+        // Tag the 512-bytes block with the address of the allocation block
+        *((aligned_uint*) (start & ~((uintptr_t) block_size - 1)) - 1) = block[variable_address];
+        
+        aligned_uint allocated = ((aligned_uint) 1) << area;
+        if ( used != allocated )
+        {
+            clear_bits(bitmap, used & ~allocated);
+        }
+        return (void*) start;
+    }
+    return NULL;
+}
+
+
+/*
+    Zones and heaps
+    
+    Each heap has its own tree of master allocation blocks. An
+    allocation zone starts with a master allocation block, which
+    is followed by fixed size allocation blocks then variable
+    size allocation blocks, each followed by its allocation memory.
+    
+    .------------------------------------------------------------.
+    | master | fixed | ... | fixed | variable | memory | ...      |
+    '------------------------------------------------------------'
+    
+    Zones are aligned on ZONE_SIZE, so that the zone of any of its
+    allocation blocks is found from its address. Most zones are
+    ZONE_SIZE bytes and get as many variable size allocation blocks
+    as fit; a zone for a larger size is a multiple of ZONE_SIZE and
+    has a single one. The zones are carved out of regions mapped
+    for the heap.
+    
+    The master allocation block of the first zone is the root of
+    the tree. The master allocation blocks of the other zones are
+    listed in the tree, filling it level by level.
+    
+    The address which ends the info block of a variable size
+    allocation block is the end address of the block. It is also
+    used to tag the 512-bytes blocks of its allocation memory.
+    The end address of its allocation memory, in the reserved
+    slot, is the address of the next variable size allocation
+    block of the zone, unless it is the end of the zone.
+    
+    Each fixed size allocation block of a new zone starts with a
+    1-byte allocation block, so that any of them can be filled
+    first. A thread only allocates in the fixed size allocation
+    blocks it owns, and claims an unowned one of the zone when
+    they are full, so that threads do not share cache lines.
+    Threads are numbered, and a thread which exits leaves its
+    number and its blocks to the next thread that starts.
+    
+    The slots at the end of the data block of the master allocation
+    block at the start of a zone hold the owner of each of its fixed
+    size allocation blocks, along with the slot types found full in
+    it, the heap of the zone, and the range of variable sizes for
+    which all the free memory was too small or more than twice as
+    large. Allocations skip the blocks and the zones that cannot
+    hold them, and freeing memory in a zone clears its hints. A
+    search which fails sets a hint before searching once more, so
+    that memory freed meanwhile is not missed. Each thread tries
+    the zone of its latest allocation in the heap first, then the
+    zones in turn, starting after the one where the previous search
+    succeeded. Each heap remembers
+    the range of variable sizes that no zone could hold, so that the
+    zones are only searched again for them after memory was freed in
+    a full zone.
+    
+    Padded allocations use whole cache lines for objects under
+    contention.
+    
+    Destroying a heap unmaps all of its regions at once, after
+    the hoards of all threads were flushed. Each thread adds its
+    hoard to a list when it first hoards memory, and removes it
+    when it exits. An allocation takes one of the latest entries
+    of the hoard of the thread when it belongs to the same heap
+    and is less than twice the size.
+    
+    Trimming flushes the hoards of all threads, then gives the
+    pages of unused allocation memory back to the system. The
+    zones stay in the tree since other threads
+    may be looking at them without holding any lock.
+*/
+
+// First variable size allocation block of a zone
+static aligned_uint *zone_variable_block(aligned_uint *const zone)
+{
+    return zone + (1 + ZONE_FIXED_BLOCKS) * (block_size / alignment);
+}
+
+// Keep the index of an exiting thread for reuse, heap_init_lock must
+// be held
+static void keep_free_index(int index)
+{
+    if ( free_index_count == free_index_capacity )
+    {
+        int capacity = free_index_capacity == 0 ? 64 : 2 * free_index_capacity;
+        int *indices = realloc(free_indices, capacity * sizeof (int));
+        if ( indices == NULL )
+        {
+            // The index is not reused
+            return;
+        }
+        free_indices = indices;
+        free_index_capacity = capacity;
+    }
+    free_indices[free_index_count++] = index;
+}
+
+// Give the index of an exiting thread back, along with the fixed size
+// allocation blocks it owns
+static void release_thread_index(void *const value)
+{
+    mutex_lock(&heap_init_lock);
+    keep_free_index((int) (uintptr_t) value - 1);
+    mutex_unlock(&heap_init_lock);
+    thread_index = -1;
+}
+
+// Number the threads, reusing the numbers of the threads which exited
+static int get_thread_index(void)
+{
+    if ( thread_index == -1 )
+    {
+        mutex_lock(&heap_init_lock);
+        thread_index = free_index_count > 0 ? free_indices[--free_index_count] : thread_count++;
+        mutex_unlock(&heap_init_lock);
+        thread_key_set(index_key, (void*) (uintptr_t) (thread_index + 1));
+    }
+    return thread_index;
+}
+
+// Allocate a fixed size slot in a fixed size allocation block of a zone
+// owned by the thread. A search which fails marks the slot type as full
+// in the owner slot then searches again, so that memory freed meanwhile
+// is not missed; memory freed later clears it.
+static void *allocate_owned_fixed(aligned_uint *const zone, int index, int slot_type)
+{
+    v_aligned_uint_ptr owner = zone + master_owners + index - 1;
+    aligned_uint type_bit = ((aligned_uint) 1) << (owner_full_shift + slot_type);
+    aligned_uint *block = zone + index * (block_size / alignment);
+    void *memory = allocate_fixed_size(block, slot_type);
+    if ( memory == NULL )
+    {
+        set_full_hint(owner, type_bit);
+        memory = allocate_fixed_size(block, slot_type);
+        if ( memory != NULL )
+        {
+            clear_full_hint(owner, type_bit);
+        }
+    }
+    return memory;
+}
+
+// Allocate a fixed size slot in the fixed size allocation blocks of a
+// zone, which follow the master allocation block. A thread only uses
+// the blocks it owns, and claims an unowned block when they are full,
+// so that threads do not share cache lines.
+static void *allocate_fixed_in_zone(aligned_uint *const zone, int slot_type)
+{
+    aligned_uint thread = get_thread_index() + 1;
+    aligned_uint type_bit = ((aligned_uint) 1) << (owner_full_shift + slot_type);
+    int unowned = 0;
+    for ( int index = 1; index <= ZONE_FIXED_BLOCKS; ++index )
+    {
+        aligned_uint owner = zone[master_owners + index - 1];
+        if ( owner == 0 && unowned == 0 )
+        {
+            unowned = index;
+        }
+        if ( (owner & UINT32_MAX) == thread && !(owner & type_bit) )
+        {
+            void *memory = allocate_owned_fixed(zone, index, slot_type);
+            if ( memory != NULL )
+            {
+                return memory;
+            }
+        }
+    }
+    for ( int index = unowned; index != 0 && index <= ZONE_FIXED_BLOCKS; ++index )
+    {
+        if ( compare_and_set(zone + master_owners + index - 1, 0, thread) )
+        {
+            return allocate_owned_fixed(zone, index, slot_type);
+        }
+    }
+    return NULL;
+}
+
+// Allocate an area in the variable size allocation blocks of a zone;
+// each of them ends where the next one starts
+static void *allocate_variable_in_zone(aligned_uint *const zone, size_t size, size_t align, size_t *const refused)
+{
+    void *memory = NULL;
+    aligned_uint *block = zone_variable_block(zone);
+    do {
+        memory = allocate_variable_size(block, size, align > alignment ? align : alignment, refused);
+        block = (aligned_uint*) block[variable_end];
+    } while ( memory == NULL && (uintptr_t) block - (uintptr_t) zone < ZONE_SIZE );
+    return memory;
+}
+
+// Check whether the hint of a zone rules out a variable size. The hint
+// holds the smallest size which did not fit in its high half, and in
+// its low half the bound below which the twice-the-size rule refuses
+// all the free memory large enough. Returns the bound, or 0.
+static size_t variable_failed(aligned_uint *const zone, size_t size)
+{
+    aligned_uint failed = zone[master_variable_failed];
+    if ( failed == 0 || size < failed >> 32 || size >= (failed & UINT32_MAX) )
+    {
+        return 0;
+    }
+    return failed & UINT32_MAX;
+}
+
+// Bound of the sizes which cannot use any of the refused free memory
+static size_t refused_bound(size_t refused)
+{
+    return refused > 2 * (size_t) UINT32_MAX ? UINT32_MAX : (refused + 1) / 2;
+}
+
+// Allocate memory in the specified zone. A variable size search which
+// fails sets the hint of the zone then searches again, so that memory
+// freed during the first search is not missed; memory freed later
+// clears the hint.
+static void *allocate_in_zone(aligned_uint *const zone, size_t size, size_t align)
+{
+    // Fixed size slots are aligned on their size
+    int slot_type = fixedsize_slot_type(size > align ? size : align);
+    if ( slot_type != -1 )
+    {
+        void *memory = allocate_fixed_in_zone(zone, slot_type);
+        if ( memory != NULL )
+        {
+            return memory;
+        }
+    }
+    
+    // Larger sizes do not fit in free memory too small for a size, but
+    // free memory which was refused because it is more than twice the
+    // size may hold them. The failure of a size which could also use a
+    // fixed size slot, or with a larger alignment, is not recorded.
+    if ( variable_failed(zone, size) )
+    {
+        return NULL;
+    }
+    size_t refused = SIZE_MAX;
+    void *memory = allocate_variable_in_zone(zone, size, align, &refused);
+    if ( memory == NULL && slot_type == -1 && align <= alignment && size < refused_bound(refused) )
+    {
+        v_aligned_uint_ptr failed = zone + master_variable_failed;
+        aligned_uint hint = (aligned_uint) size << 32 | refused_bound(refused);
+        aligned_uint h;
+        do {
+            h = *failed;
+        } while ( !compare_and_set(failed, h, hint) );
+        refused = SIZE_MAX;
+        memory = allocate_variable_in_zone(zone, size, align, &refused);
+        if ( memory != NULL || size >= refused_bound(refused) )
+        {
+            clear_full_hint(failed, ~(aligned_uint) 0);
+        }
+    }
+    return memory;
+}
+
+// Zone at the given position in the tree, which is filled level by level
+static aligned_uint *tree_zone(aligned_uint *const master, int index)
+{
+    if ( index == 0 )
+    {
+        return master;
+    }
+    aligned_uint *parent = tree_zone(master, (index - 1) / master_slot_count);
+    return (aligned_uint*) parent[(index - 1) % master_slot_count];
+}
+
+// Map a region aligned on ZONE_SIZE. In hardened mode the memory
+// mapped around it for the alignment serves as guard pages, otherwise
+// it is given back.
+static char *map_region(bt_heap *const heap, const size_t size)
+{
+#ifdef HARDENED
+    size_t guard = sysconf(_SC_PAGESIZE);
+#else
+    size_t guard = 0;
+#endif
+    region *r = malloc(sizeof (region));
+    if ( r == NULL )
+    {
+        return NULL;
+    }
+    r->size = size + ZONE_SIZE + guard;
+    r->memory = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( r->memory == MAP_FAILED )
+    {
+        free(r);
+        return NULL;
+    }
+    char *start = (char*) (((uintptr_t) r->memory + guard + ZONE_SIZE - 1) & ~((uintptr_t) ZONE_SIZE - 1));
+    char *end = start + size;
+    char *limit = r->memory + r->size;
+#ifdef HARDENED
+    if ( mprotect(r->memory, start - r->memory, PROT_NONE) != 0 ||
+        mprotect(end, limit - end, PROT_NONE) != 0 )
+    {
+        munmap(r->memory, r->size);
+        free(r);
+        return NULL;
+    }
+#else
+    if ( start > r->memory )
+    {
+        munmap(r->memory, start - r->memory);
+    }
+    if ( limit > end )
+    {
+        munmap(end, limit - end);
+    }
+    r->memory = start;
+    r->size = size;
+#endif
+    r->next = heap->regions;
+    heap->regions = r;
+    return start;
+}
+
+// Unmap all the regions of a heap
+static void unmap_regions(bt_heap *const heap)
+{
+    region *r = heap->regions;
+    while ( r != NULL )
+    {
+        region *next = r->next;
+        munmap(r->memory, r->size);
+        free(r);
+        r = next;
+    }
+}
+
+// Get the memory of a zone. Zones are carved out of regions of the
+// heap, which keeps the mappings few; a zone bigger than a quarter of
+// a region is mapped on its own.
+static aligned_uint *zone_memory(bt_heap *const heap, const size_t zone_size)
+{
+    if ( zone_size > (size_t) (heap->region_end - heap->region_free) )
+    {
+        if ( zone_size > REGION_SIZE / 4 )
+        {
+            return (aligned_uint*) map_region(heap, zone_size);
+        }
+        char *memory = map_region(heap, REGION_SIZE);
+        if ( memory == NULL )
+        {
+            return NULL;
+        }
+        heap->region_free = memory;
+        heap->region_end = memory + REGION_SIZE;
+    }
+    aligned_uint *zone = (aligned_uint*) heap->region_free;
+    heap->region_free += zone_size;
+    return zone;
+}
+
+// Create an allocation zone with the specified amount of allocation
+// memory for each of its variable size allocation blocks. A zone of
+// ZONE_SIZE bytes gets as many of them as fit; a larger zone has one.
+static aligned_uint *create_zone(bt_heap *const heap, size_t area)
+{
+    size_t header = (1 + ZONE_FIXED_BLOCKS) * block_size;
+    if ( area < MIN_ZONE_AREA )
+    {
+        area = MIN_ZONE_AREA;
+    }
+    
+    // Size of a variable size allocation block with its memory
+    size_t stride = block_size + ((area + block_size - 1) & ~((size_t) block_size - 1));
+    size_t zone_size = ZONE_SIZE;
+    int count = 1;
+    if ( stride > ZONE_SIZE - header )
+    {
+        zone_size = (header + stride + ZONE_SIZE - 1) & ~((size_t) ZONE_SIZE - 1);
+    }
+    else
+    {
+        // Share the rest of the zone between the blocks
+        count = (ZONE_SIZE - header) / stride;
+        stride = ((ZONE_SIZE - header) / count) & ~((size_t) block_size - 1);
+    }
+    
+    aligned_uint *zone = zone_memory(heap, zone_size);
+    if ( zone == NULL )
+    {
+        return NULL;
+    }
+    memset(zone, 0, header);
+    
+    // Empty master allocation block
+    zone[master_heap] = (uintptr_t) heap;
+    zone[block_size / alignment - 1] = 1;
+    
+    // 1-byte allocation blocks at the top of the fixed size allocation
+    // blocks, so that the info block before each of them is not zero
+    for ( int n = 1; n <= ZONE_FIXED_BLOCKS; ++n )
+    {
+        zone[(n + 1) * (block_size / alignment) - 1] = fixedsize_test[0];
+    }
+    
+    // The first slot of each variable size allocation block holds all
+    // of its allocation memory, which ends where the next block starts
+    aligned_uint *block = zone_variable_block(zone);
+    uintptr_t zone_end = (uintptr_t) zone + zone_size;
+    for ( int n = 1; n <= count; ++n )
+    {
+        uintptr_t end = n == count ? zone_end : (uintptr_t) block + stride;
+        block[0] = (uintptr_t) (block + block_size / alignment);
+        for ( int slot = 1; slot <= variable_end; ++slot )
+        {
+            block[slot] = end;
+        }
+        block[variable_bitmap] = 0;
+        block[variable_address] = block[0];
+        block = (aligned_uint*) end;
+    }
+    return zone;
+}
+
+// Link a zone to a master allocation block of the tree at the given depth
+static int link_zone(aligned_uint *const master, aligned_uint *const zone, int depth)
+{
+    v_aligned_uint_ptr bitmap = master + (block_size / alignment - 1);
+    if ( depth == 0 )
+    {
+        aligned_uint b = *bitmap;
+        aligned_uint available = ~b & ((((aligned_uint) 1) << master_slot_count) - 1) << 1;
+        if ( available == 0 )
+        {
+            return 0;
+        }
+        int shift = __builtin_ctzll(available);
+        master[shift - 1] = (uintptr_t) zone;
+        while ( !compare_and_set(bitmap, b, b | ((aligned_uint) 1) << shift) )
+        {
+            b = *bitmap;
+        }
+        return 1;
+    }
+    for ( int slot = 0; slot < master_slot_count; ++slot )
+    {
+        if ( (*bitmap & ((aligned_uint) 2) << slot) &&
+            link_zone((aligned_uint*) master[slot], zone, depth - 1) )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Free the memory of a hoard
+static void flush_hoard(hoard *const h)
+{
+    if ( !h->registered )
+    {
+        return;
+    }
+    mutex_lock(&h->lock);
+    void **hoarded = h->freed_list;
+    h->freed_list = NULL;
+    h->hoard_size = 0;
+    mutex_unlock(&h->lock);
+    while ( hoarded != NULL )
+    {
+        void **next = *hoarded;
+        
+        // Try until it works rather than hoarding it again
+        while ( free_internal(hoarded, 1) == 0 );
+        hoarded = next;
+    }
+}
+
+// Free the memory hoarded by all threads, heap_init_lock must be held
+static void flush_hoards(void)
+{
+    for ( hoard *h = hoards; h != NULL; h = h->next )
+    {
+        flush_hoard(h);
+    }
+}
+
+// Remove the hoard of an exiting thread from the list and free its memory
+static void release_hoard(void *const exiting)
+{
+    hoard *h = exiting;
+    mutex_lock(&heap_init_lock);
+    hoard **link = &hoards;
+    while ( *link != h )
+    {
+        link = &(*link)->next;
+    }
+    *link = h->next;
+    mutex_unlock(&heap_init_lock);
+    
+    flush_hoard(h);
+    h->registered = 0;
+    mutex_destroy(&h->lock);
+}
+
+#ifndef HARDENED
+size_t bt_usable_size(const void *const memory);
+
+// Take memory out of the hoard of the thread for an allocation in the
+// heap, if one of the most recent entries belongs to the heap and is
+// large enough but less than twice the size
+static void *reuse_hoarded(bt_heap *const heap, size_t size)
+{
+    if ( thread_hoard.freed_list == NULL )
+    {
+        return NULL;
+    }
+    mutex_lock(&thread_hoard.lock);
+    void **pred = (void**) &thread_hoard.freed_list;
+    for ( int n = 0; *pred != NULL && n < HOARD_REUSE; ++n )
+    {
+        void *memory = *pred;
+        size_t usable = bt_usable_size(memory);
+        aligned_uint *zone = block_zone(allocation_block(memory));
+        if ( usable >= size && usable - size <= size && (bt_heap*) zone[master_heap] == heap )
+        {
+            unhoard(pred);
+            thread_hoard.hoard_size -= usable;
+            mutex_unlock(&thread_hoard.lock);
+            return memory;
+        }
+        pred = memory;
+    }
+    mutex_unlock(&thread_hoard.lock);
+    return NULL;
+}
+#endif
+
+// Create a heap and add it to the list, heap_init_lock must be held
+static bt_heap *create_heap(void)
+{
+    bt_heap *heap = malloc(sizeof (bt_heap));
+    if ( heap == NULL )
+    {
+        return NULL;
+    }
+    heap->regions = NULL;
+    heap->region_free = NULL;
+    heap->region_end = NULL;
+    heap->master = create_zone(heap, 0);
+    if ( heap->master == NULL )
+    {
+        unmap_regions(heap);
+        free(heap);
+        return NULL;
+    }
+    heap->recent = heap->master;
+    heap->id = ++heap_ids;
+    heap->zone_count = 1;
+    heap->cursor = 0;
+    heap->failed_size = SIZE_MAX;
+    heap->failed_bound = 0;
+    heap->failed_freed = freed_zones;
+    mutex_init(&heap->zone_lock);
+    heap->next = heaps;
+    heaps = heap;
+    return heap;
+}
+
+bt_heap *bt_heap_create(void)
+{
+    mutex_lock(&heap_init_lock);
+    bt_heap *heap = create_heap();
+    mutex_unlock(&heap_init_lock);
+    return heap;
+}
+
+// Allocate memory with the specified power of two alignment
+static void *heap_allocate(bt_heap *const heap, size_t size, size_t align)
+{
+    if ( size == 0 )
+    {
+        // Never return an empty area
+        size = 1;
+    }
+    if ( size > max_request || align > max_request - size )
+    {
+        // Too large for any zone
+        return NULL;
+    }
+    
+#ifndef HARDENED
+    // Memory hoarded by the thread comes first, unless padded or aligned
+    if ( align <= alignment )
+    {
+        void *memory = reuse_hoarded(heap, size);
+        if ( memory != NULL )
+        {
+            return memory;
+        }
+    }
+#endif
+    
+    // Try the zone of the latest allocation of the thread first
+    aligned_uint *zone = recent_heap == heap->id ? recent_zone : heap->recent;
+    void *memory = allocate_in_zone(zone, size, align);
+    if ( memory != NULL )
+    {
+        recent_heap = heap->id;
+        recent_zone = zone;
+        return memory;
+    }
+    
+    // The tree is not searched again for variable sizes that no zone
+    // could hold, until memory gets freed in a zone found full. They are
+    // only recorded when the hints of all the zones rule them out.
+    int freed = freed_zones;
+    int variable = fixedsize_slot_type(size) == -1 && align <= alignment;
+    size_t bound = 0;
+    if ( !variable || freed != heap->failed_freed || size < heap->failed_size || size >= heap->failed_bound )
+    {
+        // Search the zones in turn after the one which last had space
+        bound = variable ? SIZE_MAX : 0;
+        int count = heap->zone_count;
+        int start = heap->cursor;
+        for ( int n = 1; memory == NULL && n <= count; ++n )
+        {
+            int index = (start + n) % count;
+            zone = tree_zone(heap->master, index);
+            memory = allocate_in_zone(zone, size, align);
+            if ( memory != NULL )
+            {
+                heap->cursor = index;
+            }
+            else if ( bound != 0 )
+            {
+                size_t zone_bound = variable_failed(zone, size);
+                bound = zone_bound < bound ? zone_bound : bound;
+            }
+        }
+    }
+    if ( memory == NULL )
+    {
+        mutex_lock(&heap->zone_lock);
+        if ( bound != 0 )
+        {
+            heap->failed_size = size;
+            heap->failed_bound = bound;
+            heap->failed_freed = freed;
+        }
+        
+        // Another thread may have added a zone in the meantime
+        zone = heap->recent;
+        memory = allocate_in_zone(zone, size, align);
+        if ( memory == NULL )
+        {
+            // Use the predictor to size the new zone
+            size_t predicted = predictor[update_predictor(size)];
+            size_t area = size + align + alignment + block_size;
+            if ( predicted <= max_request / variable_slot_count && predicted * variable_slot_count > area )
+            {
+                area = predicted * variable_slot_count;
+            }
+            zone = create_zone(heap, area);
+            if ( zone != NULL )
+            {
+                memory = allocate_in_zone(zone, size, align);
+                assert( memory != NULL );
+                for ( int depth = 0; !link_zone(heap->master, zone, depth); ++depth );
+                heap->cursor = heap->zone_count++;
+                heap->recent = zone;
+            }
+        }
+        mutex_unlock(&heap->zone_lock);
+    }
+    if ( memory != NULL )
+    {
+        recent_heap = heap->id;
+        recent_zone = zone;
+    }
+    return memory;
+}
+
+void *bt_heap_malloc(bt_heap *const heap, size_t size)
+{
+    return heap_allocate(heap, size, 1);
+}
+
+// Allocate memory which shares no cache line with other allocations
+void *bt_heap_malloc_padded(bt_heap *const heap, size_t size)
+{
+    if ( size > SIZE_MAX - CACHE_LINE_SIZE + 1 )
+    {
+        // Rounding up would wrap around
+        return NULL;
+    }
+    size_t padded = (size + CACHE_LINE_SIZE - 1) & ~((size_t) CACHE_LINE_SIZE - 1);
+    return heap_allocate(heap, size == 0 ? CACHE_LINE_SIZE : padded, CACHE_LINE_SIZE);
+}
+
+// The alignment must be a power of two
+void *bt_heap_aligned_alloc(bt_heap *const heap, size_t align, size_t size)
+{
+    if ( align == 0 || (align & (align - 1)) != 0 )
+    {
+        return NULL;
+    }
+    return heap_allocate(heap, size, align);
+}
+
+// All the memory of the heap is released at once; no thread may use
+// it afterwards. The hoards of all threads are flushed first since
+// they may hold memory of the heap.
+void bt_heap_destroy(bt_heap *const heap)
+{
+    mutex_lock(&heap_init_lock);
+    bt_heap **link = &heaps;
+    while ( *link != heap )
+    {
+        link = &(*link)->next;
+    }
+    *link = heap->next;
+    flush_hoards();
+    mutex_unlock(&heap_init_lock);
+    
+    unmap_regions(heap);
+    mutex_destroy(&heap->zone_lock);
+    free(heap);
+}
+
+// Give the memory of a variable size allocation block back to the
+// system if none of it is in use
+static void trim_block(aligned_uint *const block)
+{
+    v_aligned_uint_ptr bitmap = block + variable_bitmap;
+    aligned_uint all = (((aligned_uint) 1) << variable_slot_count) - 1;
+    if ( !compare_and_set(bitmap, 0, all) )
+    {
+        // Memory in use
+        return;
+    }
+    
+    // Merge the free memory back into the first slot
+    uintptr_t start = block[variable_address];
+    uintptr_t end = block[variable_end];
+    block[0] = start;
+    for ( int slot = 1; slot < variable_slot_count; ++slot )
+    {
+        block[slot] = end;
+    }
+    
+    // The pages get cleared when used again; the boundary tags are
+    // written again on allocation
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t first = (start + page - 1) & ~(page - 1);
+    uintptr_t last = end & ~(page - 1);
+    if ( last > first )
+    {
+        madvise((void*) first, last - first, MADV_DONTNEED);
+    }
+    clear_bits(bitmap, all);
+    clear_full_hint(block_zone(block) + master_variable_failed, ~(aligned_uint) 0);
+}
+
+// Trim the variable size allocation blocks of a zone
+static void trim_zone(aligned_uint *const zone)
+{
+    aligned_uint *block = zone_variable_block(zone);
+    do {
+        trim_block(block);
+        block = (aligned_uint*) block[variable_end];
+    } while ( (uintptr_t) block - (uintptr_t) zone < ZONE_SIZE );
+}
+
+// Trim a zone and the zones linked to it
+static void trim_zones(aligned_uint *const master)
+{
+    trim_zone(master);
+    aligned_uint b = master[block_size / alignment - 1];
+    for ( int slot = 0; slot < master_slot_count; ++slot )
+    {
+        if ( b & ((aligned_uint) 2) << slot )
+        {
+            trim_zones((aligned_uint*) master[slot]);
+        }
+    }
+}
+
+// Flush the hoards of all threads and give the memory of free zones
+// back to the system
+void bt_trim(void)
+{
+    mutex_lock(&heap_init_lock);
+    flush_hoards();
+    for ( bt_heap *heap = heaps; heap != NULL; heap = heap->next )
+    {
+        heap->recent = heap->master;
+        heap->cursor = 0;
+        trim_zones(heap->master);
+    }
+    mutex_unlock(&heap_init_lock);
+}
+
+// No heap or zone may be added and no hoard may change while the
+// process forks
+static void fork_prepare(void)
+{
+    mutex_lock(&heap_init_lock);
+    for ( bt_heap *heap = heaps; heap != NULL; heap = heap->next )
+    {
+        mutex_lock(&heap->zone_lock);
+    }
+    for ( hoard *h = hoards; h != NULL; h = h->next )
+    {
+        mutex_lock(&h->lock);
+    }
+}
+
+static void fork_parent(void)
+{
+    for ( hoard *h = hoards; h != NULL; h = h->next )
+    {
+        mutex_unlock(&h->lock);
+    }
+    for ( bt_heap *heap = heaps; heap != NULL; heap = heap->next )
+    {
+        mutex_unlock(&heap->zone_lock);
+    }
+    mutex_unlock(&heap_init_lock);
+}
+
+// Only the forking thread is left in the child. The hoards of the
+// other threads are flushed and dropped. Slots which they were
+// updating remain marked as used; that memory is lost but the
+// bitmaps stay consistent.
+static void fork_child(void)
+{
+    for ( bt_heap *heap = heaps; heap != NULL; heap = heap->next )
+    {
+        mutex_init(&heap->zone_lock);
+    }
+    hoard **link = &hoards;
+    while ( *link != NULL )
+    {
+        hoard *h = *link;
+        mutex_init(&h->lock);
+        if ( h == &thread_hoard )
+        {
+            link = &h->next;
+        }
+        else
+        {
+            flush_hoard(h);
+            *link = h->next;
+        }
+    }
+    
+    // Only this thread is left, the indices of the others can be reused
+    free_index_count = 0;
+    for ( int index = 0; index < thread_count; ++index )
+    {
+        if ( index != thread_index )
+        {
+            keep_free_index(index);
+        }
+    }
+    mutex_init(&heap_init_lock);
+}
+
+static void __attribute__((constructor)) init_allocator(void)
+{
+    mutex_init(&heap_init_lock);
+    thread_key_create(&hoard_key, release_hoard);
+    thread_key_create(&index_key, release_thread_index);
+    at_fork(fork_prepare, fork_parent, fork_child);
+}
+
+// The default heap is created on first use
+static bt_heap *get_default_heap(void)
+{
+    bt_heap *heap = default_heap;
+    if ( heap == NULL )
+    {
+        mutex_lock(&heap_init_lock);
+        if ( default_heap == NULL )
+        {
+            compare_and_set(&default_heap, NULL, create_heap());
+        }
+        heap = default_heap;
+        mutex_unlock(&heap_init_lock);
+    }
+    return heap;
+}
+
+void *bt_malloc(size_t size)
+{
+    bt_heap *heap = get_default_heap();
+    return heap == NULL ? NULL : bt_heap_malloc(heap, size);
+}
+
+void *bt_malloc_padded(size_t size)
+{
+    bt_heap *heap = get_default_heap();
+    return heap == NULL ? NULL : bt_heap_malloc_padded(heap, size);
+}
+
+void *bt_aligned_alloc(size_t align, size_t size)
+{
+    bt_heap *heap = get_default_heap();
+    return heap == NULL ? NULL : bt_heap_aligned_alloc(heap, align, size);
+}
+
+void bt_free(void *const memory)
+{
+    if ( memory != NULL )
+    {
+        free_internal(memory, 0);
+    }
+}
+
+// Usable size of allocated memory, worked out from the allocation block
+size_t bt_usable_size(const void *const memory)
+{
+    if ( memory == NULL )
+    {
+        return 0;
+    }
+    aligned_uint *block = allocation_block(memory);
+    if ( *(block - 1) & uchar_mask )
+    {
+        int slot_type = -1;
+        fixedsize_block(memory, &slot_type);
+        return fixedsize_alignment[slot_type];
+    }
+    else
+    {
+        block -= block_size / alignment;
+        int slot = variable_slot(memory, block);
+        return area_usable((uintptr_t) memory, block[slot + 1]);
+    }
+}
+
+// Free memory of a known size, such as the size passed to C++ sized
+// deallocation. The size spares identifying the kind of slot.
+void bt_free_sized(void *const memory, size_t size)
+{
+    if ( memory == NULL )
+    {
+        return;
+    }
+    assert( size <= bt_usable_size(memory) );
+    
+    aligned_uint *block = allocation_block(memory);
+    if ( size <= (size_t) fixedsize_alignment[biggest_slot] && (*(block - 1) & uchar_mask) )
+    {
+        free_fixed_size_memory(memory, block, block_zone(block), fixedsize_slot_type(size), 0);
+    }
+    else
+    {
+        // Sizes larger than fixed-size slots are always variable
+        free_variable_size_memory(memory, block - block_size / alignment, 0);
+    }
+}
+
+int main(int n, char* args[])
+{
+    size_t sizes[] = {400, 8, 64, 504, 1, 64, 200, 320, 1000, 800, 3, 184, 640, 208, 720, 480, 240, 800, 560, 720, 1000, 192, 112,
+        1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000, 6000, 400};
+    for ( int i = 0; i < sizeof(sizes) / sizeof(size_t); ++i )
+    {
+        printf("Alloc %lu - new median: %lu, predictor =", sizes[i], predictor[update_predictor(sizes[i])]);
+        for ( int n = 0; n < slot_type_count || p_count[n] > 0; ++n )
+        {
+            printf(" (%lu: %u)", predictor[n], p_count[n]);
+        }
+        puts("");
+    }
+    printf("CPU type: %s endian\n", LITTLE_ENDIAN_CPU? "little": "big");
+    aligned_uint *block;
+    if ( posix_memalign((void**) &block, block_alignment, block_size) == 0 )
+    {
+        int index = block_size / alignment;
+        aligned_uint bitmap = 0x19;      // 00011001
+        block[--index] = 1;
+        block[--index] = bitmap;
+        free_fixed_size_memory((char*) (block + index) + 4, block, NULL, -1, 0);
+        printf("bitmap before free = %llX\n", bitmap);
+        printf("bitmap after free = %llX\n", block[index]);
+    }
+    bt_heap *heap = bt_heap_create();
+    if ( heap != NULL )
+    {
+        char *small = bt_heap_malloc(heap, 3);
+        char *large = bt_heap_malloc(heap, 1000);
+        printf("heap allocations: %p %p\n", small, large);
+        char *aligned = bt_heap_aligned_alloc(heap, 4096, 100);
+        printf("aligned allocation: %p (%s)\n", aligned, (uintptr_t) aligned % 4096 == 0 ? "ok" : "misaligned");
+        printf("usable sizes: %lu %lu %lu\n", bt_usable_size(small), bt_usable_size(large), bt_usable_size(aligned));
+        char *padded = bt_heap_malloc_padded(heap, 10);
+        printf("padded allocation: %p, usable size %lu (%s)\n", padded, bt_usable_size(padded),
+            (uintptr_t) padded % CACHE_LINE_SIZE == 0 && bt_usable_size(padded) == CACHE_LINE_SIZE ? "ok" : "shares a cache line");
+        bt_free_sized(aligned, 100);
+        bt_free(padded);
+        bt_free(large);
+        bt_trim();
+        char *trimmed = bt_heap_malloc(heap, 1000);
+        printf("allocation after trim: %p (%s)\n", trimmed, trimmed == large ? "reused" : "not reused");
+        bt_free(small);
+        bt_heap_destroy(heap);      // releases trimmed too
     }
     return 0;
 }